@@ -28,6 +28,8 @@
 #include <fcntl.h>
 #include <linux/limits.h>
 #include <stdatomic.h>
+#include <sys/syscall.h>
+#include <inttypes.h>
 
 #include "error_codes.h"
 #include "wimps_read.h"
@@ -35,9 +37,92 @@
 // use to prevent multiple samples getting written at the same time
 atomic_flag wimps_sigprof_active = ATOMIC_FLAG_INIT;
 
-// should be set by wimps_setup
+// should be set by wimps_setup, -1 in count mode (see wimps_flush_counts)
 int wimps_trace_fd;
 
+// the name of the trace file, which is also its header line (see wimps_create_trace_file).
+// Count mode rewrites the whole file whenever it flushes, so it needs both.
+char wimps_trace_path[PATH_MAX];
+
+// the directory the trace file was created in (the working directory at startup).
+// wimps_trace_path is relative to it, and the program is free to chdir somewhere else afterwards.
+int wimps_trace_dir_fd = -1;
+
+// the process that wimps_setup ran in.
+// A forked child inherits the stack table and the trace file but isn't what was being counted,
+// so it mustn't write its (stale) copy of the counts over the parent's.
+pid_t wimps_pid;
+
+// set by wimps_setup from WIMPS_MODE=count;
+// samples are aggregated in memory instead of written out one by one
+bool wimps_count_mode = false;
+
+// how many unique stacks count mode can keep, anything beyond that is only counted as dropped.
+// Can be overridden at build time (e.g. make CFLAGS=-DWIMPS_STACK_TABLE_SIZE=65536),
+// must be a power of two, see wimps_count_stack
+#ifndef WIMPS_STACK_TABLE_SIZE
+#define WIMPS_STACK_TABLE_SIZE 4096
+#endif
+
+_Static_assert((WIMPS_STACK_TABLE_SIZE & (WIMPS_STACK_TABLE_SIZE - 1)) == 0, "WIMPS_STACK_TABLE_SIZE must be a power of two");
+
+#define WIMPS_STACK_TABLE_MAX_DEPTH 128
+
+// an open addressing hash table of stack -> count for count mode.
+// It's allocated up front (and lives in .bss) because the signal handler can't call malloc.
+typedef struct _wimps_stack_entry {
+    // 0 means the slot is empty
+    atomic_uint_fast64_t hash;
+    // set once frames and depth have been filled in
+    atomic_bool ready;
+    atomic_uint_fast64_t count;
+    // sum of the sampling intervals in effect each time the stack was seen, in nanoseconds
+    atomic_uint_fast64_t weight;
+    int depth;
+    void* frames[WIMPS_STACK_TABLE_MAX_DEPTH];
+} wimps_stack_entry;
+
+wimps_stack_entry wimps_stack_table[WIMPS_STACK_TABLE_SIZE];
+
+// samples that didn't fit in the table
+atomic_uint_fast64_t wimps_stack_table_dropped = 0;
+atomic_uint_fast64_t wimps_stack_table_dropped_weight = 0;
+
+// how often count mode rewrites the trace file, in seconds (WIMPS_FLUSH_INTERVAL).
+// 0 means only at exit.
+int64_t wimps_flush_interval = 60;
+wimps_timespec wimps_last_flush = { 0, 0 };
+
+// should be set by wimps_setup
+timer_t wimps_timer;
+
+// the current sampling interval, in nanoseconds
+int64_t wimps_interval = wimps_default_interval;
+
+// CPU time wimps is allowed to spend sampling and writing, as a fraction of the CPU time the program itself uses
+// (WIMPS_OVERHEAD_BUDGET, in percent). 0 means the interval never changes.
+double wimps_overhead_budget = 0;
+
+// the interval is only ever adapted within these limits, in nanoseconds
+#define WIMPS_MIN_INTERVAL 1000000
+#define WIMPS_MAX_INTERVAL 1000000000
+
+// how long to measure the overhead for before adapting the interval, in nanoseconds
+#define WIMPS_OVERHEAD_WINDOW 1000000000
+
+// the program counts as mostly idle if it used less than this fraction of a CPU over a window
+#define WIMPS_IDLE_FRACTION 0.05
+
+// CPU time spent in the signal handler since wimps_overhead_window_start, in nanoseconds
+int64_t wimps_overhead_spent = 0;
+wimps_timespec wimps_overhead_window_start = { 0, 0 };
+// the process' CPU time at wimps_overhead_window_start
+wimps_timespec wimps_overhead_window_process_cpu = { 0, 0 };
+
+// where libpreload.so's own code is loaded, set by wimps_setup (see wimps_own_frames)
+uintptr_t wimps_code_start = 0;
+uintptr_t wimps_code_end = 0;
+
 // should be set by glibc
 extern const char* program_invocation_short_name;
 
@@ -59,9 +144,9 @@ bool wimps_write(int fd, const void* buffer, ssize_t size) {
     return true;
 }
 
-int wimps_get_timespec(wimps_timespec* const out) {
+int wimps_get_clock(const clockid_t clock, wimps_timespec* const out) {
     struct timespec result;
-    const int ret = clock_gettime(CLOCK_MONOTONIC, &result);
+    const int ret = clock_gettime(clock, &result);
 
     // we assume the out parameter is not null
     out->seconds = result.tv_sec;
@@ -70,6 +155,270 @@ int wimps_get_timespec(wimps_timespec* const out) {
     return ret;
 }
 
+int wimps_get_timespec(wimps_timespec* const out) {
+    return wimps_get_clock(CLOCK_MONOTONIC, out);
+}
+
+int64_t wimps_timespec_diff(const wimps_timespec* const from, const wimps_timespec* const to) {
+    return (to->seconds - from->seconds) * 1000000000LL + (to->nanoseconds - from->nanoseconds);
+}
+
+uint64_t wimps_hash_stack(void* const* frames, const int depth) {
+    // FNV-1a over the raw return addresses
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char* bytes = (const unsigned char*) frames;
+
+    for(size_t i = 0; i < depth * sizeof(void*); ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    // 0 is reserved for empty slots
+    return hash == 0 ? 1 : hash;
+}
+
+// how many frames at the start of a backtrace taken in the signal handler belong to wimps rather than the program:
+// the handler itself (however many frames the compiler made of it, e.g. gcc can split it into a .part.0),
+// followed by the signal trampoline that called it.
+int wimps_own_frames(void* const* frames, const int depth) {
+    int own = 0;
+
+    while(   own < depth
+          && (uintptr_t) frames[own] >= wimps_code_start
+          && (uintptr_t) frames[own] < wimps_code_end) {
+        own += 1;
+    }
+
+    return own < depth ? own + 1 : own;
+}
+
+void wimps_count_stack(void* const* frames, const int depth, const uint64_t weight) {
+    const uint64_t hash = wimps_hash_stack(frames, depth);
+    const size_t mask = WIMPS_STACK_TABLE_SIZE - 1;
+
+    for(size_t probe = 0; probe < WIMPS_STACK_TABLE_SIZE; ++probe) {
+        wimps_stack_entry* const entry = &wimps_stack_table[(hash + probe) & mask];
+        uint_fast64_t existing = atomic_load(&entry->hash);
+
+        if(existing == 0) {
+            uint_fast64_t expected = 0;
+            if(atomic_compare_exchange_strong(&entry->hash, &expected, hash)) {
+                // we own the slot now, fill it in before anyone is allowed to look at it
+                memcpy(entry->frames, frames, depth * sizeof(void*));
+                entry->depth = depth;
+                atomic_store(&entry->count, 1);
+                atomic_store(&entry->weight, weight);
+                atomic_store(&entry->ready, true);
+                return;
+            }
+
+            // someone else got there first, see if it's the same stack
+            existing = expected;
+        }
+
+        if(   existing == hash
+           && atomic_load(&entry->ready)
+           && entry->depth == depth
+           && memcmp(entry->frames, frames, depth * sizeof(void*)) == 0) {
+            atomic_fetch_add(&entry->count, 1);
+            atomic_fetch_add(&entry->weight, weight);
+            return;
+        }
+    }
+
+    atomic_fetch_add(&wimps_stack_table_dropped, 1);
+    atomic_fetch_add(&wimps_stack_table_dropped_weight, weight);
+}
+
+// writes the header and the current contents of the stack table to fd
+bool wimps_write_counts(const int fd) {
+    if(! (wimps_write(fd, wimps_trace_path, strlen(wimps_trace_path)) && wimps_write(fd, "\n", 1))) {
+        return false;
+    }
+
+    for(size_t i = 0; i < WIMPS_STACK_TABLE_SIZE; ++i) {
+        wimps_stack_entry* const entry = &wimps_stack_table[i];
+
+        if(! atomic_load(&entry->ready)) {
+            continue;
+        }
+
+        const uint64_t count = atomic_load(&entry->count);
+        const uint64_t weight = atomic_load(&entry->weight);
+
+        if(! (   wimps_write(fd, "a", 1)
+              && wimps_write(fd, &count, sizeof(count))
+              && wimps_write(fd, &weight, sizeof(weight))
+              && wimps_write(fd, "b", 1))) {
+            return false;
+        }
+
+        backtrace_symbols_fd(entry->frames, entry->depth, fd);
+
+        if(! (   wimps_write(fd, wimps_end_sample_marker, wimps_end_sample_marker_strlen)
+              && wimps_write(fd, "c", 1))) {
+            return false;
+        }
+    }
+
+    const uint64_t dropped = atomic_load(&wimps_stack_table_dropped);
+    const uint64_t droppedWeight = atomic_load(&wimps_stack_table_dropped_weight);
+
+    if(dropped > 0) {
+        // shows up as a stack of its own, so it's obvious how much was lost
+        const char* const droppedSymbol = "[wimps] stack table full, samples dropped\n";
+
+        if(! (   wimps_write(fd, "a", 1)
+              && wimps_write(fd, &dropped, sizeof(dropped))
+              && wimps_write(fd, &droppedWeight, sizeof(droppedWeight))
+              && wimps_write(fd, "b", 1)
+              && wimps_write(fd, droppedSymbol, strlen(droppedSymbol))
+              && wimps_write(fd, wimps_end_sample_marker, wimps_end_sample_marker_strlen)
+              && wimps_write(fd, "c", 1))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// replaces the trace file with the current contents of the stack table,
+// so the file never grows beyond one record per unique stack.
+// The new contents go to a temporary file that's renamed over the old one once it's complete,
+// so being killed part way through a flush doesn't lose what was already there.
+// Everything used here is async-signal-safe.
+// Must be called with wimps_sigprof_active held.
+bool wimps_flush_counts() {
+    if(getpid() != wimps_pid) {
+        // see wimps_pid; pretend it worked, there's nothing for this process to write
+        return true;
+    }
+
+    char tempPath[PATH_MAX];
+    const size_t pathLength = strlen(wimps_trace_path);
+    const char tempSuffix[] = ".tmp";
+
+    if(pathLength + sizeof(tempSuffix) > sizeof(tempPath)) {
+        return false;
+    }
+
+    memcpy(tempPath, wimps_trace_path, pathLength);
+    memcpy(&tempPath[pathLength], tempSuffix, sizeof(tempSuffix));
+
+    const int fd = openat(wimps_trace_dir_fd, tempPath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(fd == -1) {
+        return false;
+    }
+
+    const bool written = wimps_write_counts(fd);
+
+    if(close(fd) == -1 || ! written || renameat(wimps_trace_dir_fd, tempPath, wimps_trace_dir_fd, wimps_trace_path) == -1) {
+        unlinkat(wimps_trace_dir_fd, tempPath, 0);
+        return false;
+    }
+
+    return true;
+}
+
+// lets the reader know that samples from this point on are wimps_interval apart
+bool wimps_write_interval(const int fd, const wimps_timespec* const time) {
+    return wimps_write(fd, "r", 1)
+        && wimps_write(fd, time, sizeof(*time))
+        && wimps_write(fd, &wimps_interval, sizeof(wimps_interval))
+        && wimps_write(fd, "c", 1);
+}
+
+bool wimps_start_timer(timer_t timer, int64_t interval) {
+    struct itimerspec timerSpec;
+
+    timerSpec.it_interval.tv_sec = interval / 1000000000;
+    timerSpec.it_interval.tv_nsec = interval % 1000000000;
+    timerSpec.it_value = timerSpec.it_interval;
+
+    return timer_settime(timer, 0, &timerSpec, NULL) == 0;
+}
+
+// keeps the CPU time wimps uses within wimps_overhead_budget of the CPU time the program itself uses.
+// The cost of sampling scales (roughly) linearly with the sample rate,
+// so once per window the interval is scaled by how far over / under budget we were.
+//
+// When the program is mostly idle, that ratio says more about how little the program did than about
+// how expensive sampling is, so instead the interval steps back towards the default. That way a program
+// that got throttled while busy is sampled at the normal rate again once it quietens down,
+// without sampling an idle program faster than it would be without a budget.
+// Must be called with wimps_sigprof_active held.
+void wimps_adapt_interval(const wimps_timespec* const handlerCpuStart) {
+    wimps_timespec now;
+    wimps_timespec handlerCpuEnd;
+    wimps_timespec processCpu;
+
+    if(   wimps_get_timespec(&now) == -1
+       || wimps_get_clock(CLOCK_THREAD_CPUTIME_ID, &handlerCpuEnd) == -1) {
+        return;
+    }
+
+    wimps_overhead_spent += wimps_timespec_diff(handlerCpuStart, &handlerCpuEnd);
+
+    const int64_t windowLength = wimps_timespec_diff(&wimps_overhead_window_start, &now);
+    if(windowLength < WIMPS_OVERHEAD_WINDOW || wimps_get_clock(CLOCK_PROCESS_CPUTIME_ID, &processCpu) == -1) {
+        return;
+    }
+
+    // the process' CPU time includes ours
+    const int64_t programCpu = wimps_timespec_diff(&wimps_overhead_window_process_cpu, &processCpu) - wimps_overhead_spent;
+    const bool idle = programCpu < windowLength * WIMPS_IDLE_FRACTION;
+
+    int64_t interval;
+
+    if(idle) {
+        interval = wimps_interval > wimps_default_interval ? wimps_interval / 2 : wimps_interval;
+
+        if(interval < wimps_default_interval) {
+            interval = wimps_default_interval;
+        }
+    } else {
+        const double overhead = (double) wimps_overhead_spent / programCpu;
+        interval = wimps_interval * (overhead / wimps_overhead_budget);
+
+        // don't overreact to a single noisy window
+        if(interval > wimps_interval * 2) {
+            interval = wimps_interval * 2;
+        } else if(interval < wimps_interval / 2) {
+            interval = wimps_interval / 2;
+        }
+    }
+
+    wimps_overhead_spent = 0;
+    wimps_overhead_window_start = now;
+    wimps_overhead_window_process_cpu = processCpu;
+
+    if(interval > WIMPS_MAX_INTERVAL) {
+        interval = WIMPS_MAX_INTERVAL;
+    } else if(interval < WIMPS_MIN_INTERVAL) {
+        interval = WIMPS_MIN_INTERVAL;
+    }
+
+    // ignore small changes, they aren't worth a record in the trace
+    const int64_t change = interval > wimps_interval ? interval - wimps_interval : wimps_interval - interval;
+    if(change < wimps_interval / 10) {
+        return;
+    }
+
+    if(! wimps_start_timer(wimps_timer, interval)) {
+        const char* const failedSetTimeMessage = "WIMPS | ERR | Could not change sampling interval";
+        wimps_write(STDERR_FILENO, failedSetTimeMessage, strlen(failedSetTimeMessage));
+        return;
+    }
+
+    wimps_interval = interval;
+
+    // count mode keeps the weight of each stack instead
+    if(! wimps_count_mode && ! wimps_write_interval(wimps_trace_fd, &now)) {
+        const char* const failedWriteMessage = "WIMPS | ERR | Could not write to trace file";
+        wimps_write(STDERR_FILENO, failedWriteMessage, strlen(failedWriteMessage));
+    }
+}
+
 void wimps_sigprof_handler() {
     if(atomic_flag_test_and_set(&wimps_sigprof_active)) {
         // there's a handler running already; drop the sample
@@ -79,17 +428,46 @@ void wimps_sigprof_handler() {
     const char* const failedWriteMessage = "WIMPS | ERR | Could not write to trace file";
     wimps_timespec currentTime = { 0, 0 };
 
+    // what the handler costs is measured in this thread's CPU time, see wimps_adapt_interval
+    wimps_timespec handlerCpuStart = { 0, 0 };
+    const bool adapting = wimps_overhead_budget > 0 && wimps_get_clock(CLOCK_THREAD_CPUTIME_ID, &handlerCpuStart) == 0;
+
     if(wimps_get_timespec(&currentTime) == -1) {
         const char* const failedGetTimespecMessage = "WIMPS | ERR | Could not get timespec";
         wimps_write(STDERR_FILENO, failedGetTimespecMessage, strlen(failedGetTimespecMessage));
         goto wimps_sigprof_exit_handler;
     }
 
+    if(wimps_count_mode) {
+        void* trace[WIMPS_STACK_TABLE_MAX_DEPTH] = { NULL };
+        const size_t size = sizeof(trace) / sizeof(trace[0]);
+        const int depth = backtrace(trace, size);
+        const int own = wimps_own_frames(trace, depth);
+
+        wimps_count_stack(&trace[own], depth - own, wimps_interval);
+
+        if(   wimps_flush_interval > 0
+           && currentTime.seconds - wimps_last_flush.seconds >= wimps_flush_interval) {
+            wimps_last_flush = currentTime;
+
+            if(! wimps_flush_counts()) {
+                goto wimps_trace_write_failed;
+            }
+        }
+
+        goto wimps_sigprof_exit_handler;
+    }
+
+    // the signal goes to whichever thread happened to be running,
+    // and there's no glibc wrapper for gettid on older versions
+    const int32_t thread = syscall(SYS_gettid);
+
     // the hardcoded characters don't convey any data (since they could be valid address bytes),
     // but they do allow for some data corruption cases to be caught, since we know what the next
     // byte should be after the addresses size, for example.
     if(! (   wimps_write(wimps_trace_fd, "a", 1)
           && wimps_write(wimps_trace_fd, &currentTime, sizeof(currentTime))
+          && wimps_write(wimps_trace_fd, &thread, sizeof(thread))
           && wimps_write(wimps_trace_fd, "b", 1))) {
         goto wimps_trace_write_failed;
     }
@@ -100,13 +478,20 @@ void wimps_sigprof_handler() {
     // According to http://man7.org/linux/man-pages/man3/backtrace.3.html,
     // backtrace and backtrace_symbols_fd is safe to call from a signal hander, but loading libgcc isn't.
     // To get around this, we force the library to load in wimps_setup, which runs before this.
-    backtrace_symbols_fd(trace, backtrace(trace, size), wimps_trace_fd);
+    const int depth = backtrace(trace, size);
+    const int own = wimps_own_frames(trace, depth);
+
+    backtrace_symbols_fd(&trace[own], depth - own, wimps_trace_fd);
     if(! (   wimps_write(wimps_trace_fd, wimps_end_sample_marker, wimps_end_sample_marker_strlen)
           && wimps_write(wimps_trace_fd, "c", 1))) {
         goto wimps_trace_write_failed;
     }
 
 wimps_sigprof_exit_handler:
+    if(adapting) {
+        wimps_adapt_interval(&handlerCpuStart);
+    }
+
     atomic_flag_clear(&wimps_sigprof_active);
     return;
 
@@ -121,6 +506,33 @@ void wimps_force_libgcc_load() {
     backtrace_symbols_fd(&dummy, 1, -1);
 }
 
+// finds the mapping (see proc(5)) that this function's code is in, which is where all of libpreload.so's code is
+bool wimps_find_own_code() {
+    const uintptr_t self = (uintptr_t) &wimps_find_own_code;
+
+    FILE* const maps = fopen("/proc/self/maps", "r");
+    if(maps == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    char line[PATH_MAX + 128];
+
+    while(! found && fgets(line, sizeof(line), maps) != NULL) {
+        uintptr_t start;
+        uintptr_t end;
+
+        if(sscanf(line, "%" SCNxPTR "-%" SCNxPTR, &start, &end) == 2 && self >= start && self < end) {
+            wimps_code_start = start;
+            wimps_code_end = end;
+            found = true;
+        }
+    }
+
+    fclose(maps);
+    return found;
+}
+
 bool wimps_set_signal_handler(void (*handler)()) {
     return signal(SIGPROF, handler) != SIG_ERR;
 }
@@ -133,21 +545,12 @@ bool wimps_create_timer(timer_t* const outTimer) {
     return timer_create(CLOCK_MONOTONIC, &signalEvent, outTimer) == 0;
 }
 
-bool wimps_start_timer(timer_t timer) {
-    struct itimerspec timerSpec;
-
-    timerSpec.it_interval.tv_sec = 0;
-    timerSpec.it_interval.tv_nsec = 200000000;
-    timerSpec.it_value = timerSpec.it_interval;
-
-    return timer_settime(timer, 0, &timerSpec, NULL) == 0;
-}
-
-int wimps_create_trace_file() {
+// the name of the file is left in wimps_trace_path
+int wimps_create_trace_file(const char* const marker) {
     const int badFd = -1;
 
-    char buffer[PATH_MAX] = { '\0' };
-    snprintf(buffer, PATH_MAX, "%s_pid%d_time%.f_%s_", wimps_trace_marker_v1, getpid(), difftime(time(NULL), (time_t) 0), program_invocation_short_name);
+    char* const buffer = wimps_trace_path;
+    snprintf(buffer, PATH_MAX, "%s_pid%d_time%.f_%s_", marker, getpid(), difftime(time(NULL), (time_t) 0), program_invocation_short_name);
 
     const int flags = O_WRONLY // write only access
                     | O_APPEND // append on write
@@ -158,7 +561,7 @@ int wimps_create_trace_file() {
     const mode_t mode = S_IRUSR  // user read permissions
                       | S_IWUSR; // user write permissions
 
-    int fd = open(buffer, flags, mode);
+    int fd = openat(wimps_trace_dir_fd, buffer, flags, mode);
 
     if(fd == badFd) {
         // something went wrong, don't bother writing to it...
@@ -197,22 +600,77 @@ void wimps_setup() {
     // see wimps_sigprof_handler for why this is needed
     wimps_force_libgcc_load();
 
-    wimps_trace_fd = wimps_create_trace_file();
+    if(! wimps_find_own_code()) {
+        wimps_report_fatal_error(WIMPS_ERROR_ASSUMPTION_FAILED, "WIMPS | ERR | Could not find libpreload.so's code in /proc/self/maps\n");
+    }
+
+    const char* const mode = getenv("WIMPS_MODE");
+    wimps_count_mode = mode != NULL && strcmp(mode, "count") == 0;
+
+    const char* const flushInterval = getenv("WIMPS_FLUSH_INTERVAL");
+    if(flushInterval != NULL) {
+        wimps_flush_interval = strtoll(flushInterval, NULL, 10);
+    }
+
+    const char* const overheadBudget = getenv("WIMPS_OVERHEAD_BUDGET");
+    if(overheadBudget != NULL) {
+        wimps_overhead_budget = strtod(overheadBudget, NULL) / 100;
+    }
+
+    wimps_trace_dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if(wimps_trace_dir_fd == -1) {
+        wimps_report_fatal_error(WIMPS_ERROR_CREATE_TRACE_FILE_FAILED, "WIMPS | ERR | Could not open the working directory\n");
+    }
+
+    wimps_trace_fd = wimps_create_trace_file(wimps_count_mode ? wimps_counts_marker_v1 : wimps_trace_marker_v2);
     if(wimps_trace_fd == -1) {
         wimps_report_fatal_error(WIMPS_ERROR_CREATE_TRACE_FILE_FAILED, "WIMPS | ERR | Could not create trace file\n");
     }
 
+    if(wimps_count_mode) {
+        // every flush replaces the file with a new one (see wimps_flush_counts),
+        // so this one would only ever point at the empty original
+        close(wimps_trace_fd);
+        wimps_trace_fd = -1;
+    }
+
+    wimps_pid = getpid();
+    wimps_get_timespec(&wimps_last_flush);
+    wimps_overhead_window_start = wimps_last_flush;
+    wimps_get_clock(CLOCK_PROCESS_CPUTIME_ID, &wimps_overhead_window_process_cpu);
+
+    if(! wimps_count_mode && ! wimps_write_interval(wimps_trace_fd, &wimps_last_flush)) {
+        wimps_report_fatal_error(WIMPS_ERROR_CREATE_TRACE_FILE_FAILED, "WIMPS | ERR | Could not write to trace file\n");
+    }
+
     if(! wimps_set_signal_handler(&wimps_sigprof_handler)) {
         wimps_report_fatal_error(WIMPS_ERROR_SIGNAL_FAILED, "WIMPS | ERR | Could not set signal handler\n");
     }
 
-    timer_t timer;
-    if(! wimps_create_timer(&timer)) {
+    if(! wimps_create_timer(&wimps_timer)) {
         wimps_report_fatal_error(WIMPS_ERROR_TIMER_CREATE_FAILED, "WIMPS | ERR | errno: %d (%s)\n", errno, strerror(errno));
     }
 
-    if(! wimps_start_timer(timer)) {
+    if(! wimps_start_timer(wimps_timer, wimps_interval)) {
         wimps_report_fatal_error(WIMPS_ERROR_TIMER_SET_TIME_FAILED, "WIMPS | ERR | Could not start timer\n");
     }
 }
 
+__attribute__((destructor))
+void wimps_teardown() {
+    if(! wimps_count_mode || getpid() != wimps_pid) {
+        // every sample has already been written,
+        // or this is a forked child that has nothing of its own to write (see wimps_pid)
+        return;
+    }
+
+    // wait for any in-flight sample to finish, then keep hold of the flag
+    // so that no more samples get taken while (or after) we write the final counts
+    while(atomic_flag_test_and_set(&wimps_sigprof_active)) {
+        // spin
+    }
+
+    if(! wimps_flush_counts()) {
+        fprintf(stderr, "WIMPS | ERR | Could not write counts to trace file\n");
+    }
+}
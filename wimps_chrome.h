@@ -0,0 +1,279 @@
+/*
+    This file is part of wimps.
+
+    wimps is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    wimps is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with wimps.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "error_codes.h"
+#include "wimps_read.h"
+#include "wimps_symbols.h"
+
+// Writes the trace as Chrome trace event JSON (for chrome://tracing, Perfetto, etc.), see
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h4I0nSsKchNAySU
+//
+// Each thread gets a flame chart of its samples: a sample covers the sampling interval before it was taken,
+// and frames that carry on from one sample to the next on the same thread stay open ("B" ... "E")
+// rather than being repeated. Only the currently open frames of each thread are kept in memory.
+
+typedef struct _wimps_chrome_thread {
+    int32_t thread;
+    // function ids, outermost first
+    size_t* frames;
+    size_t count;
+    size_t capacity;
+    // when the last sample on this thread ended, in nanoseconds since the start of the trace
+    int64_t end;
+} wimps_chrome_thread;
+
+typedef struct _wimps_chrome {
+    FILE* file;
+    bool started;
+    wimps_timespec origin;
+    int32_t pid;
+
+    // keyed by wimps_symbol_function_key, which is also what the events are called
+    wimps_string_table functions;
+    // scratch space for wimps_symbol_function_key
+    char* key;
+    size_t keySize;
+
+    wimps_chrome_thread* threads;
+    size_t threadCount;
+
+    // scratch space for the current sample's function ids, outermost first
+    size_t* frames;
+    size_t frameCapacity;
+} wimps_chrome;
+
+ErrorCode wimps_chrome_open(wimps_chrome* const chrome, const char* const path) {
+    memset(chrome, 0, sizeof(*chrome));
+
+    chrome->file = fopen(path, "w");
+    if(chrome->file == NULL) {
+        return WIMPS_ERROR_CREATE_OUTPUT_FILE_FAILED;
+    }
+
+    return WIMPS_ERROR_NONE;
+}
+
+void wimps_chrome_print_string(FILE* const file, const char* string) {
+    fputc('"', file);
+
+    for(; *string != '\0'; ++string) {
+        const unsigned char c = *string;
+
+        if(c == '"' || c == '\\') {
+            fputc('\\', file);
+            fputc(c, file);
+        } else if(c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+
+    fputc('"', file);
+}
+
+void wimps_chrome_begin(wimps_chrome* const chrome, const int32_t thread, const size_t function, const int64_t time) {
+    fprintf(chrome->file, ",\n{\"ph\":\"B\",\"pid\":%" PRId32 ",\"tid\":%" PRId32 ",\"ts\":%.3f,\"name\":",
+            chrome->pid, thread, time / 1e3);
+    wimps_chrome_print_string(chrome->file, chrome->functions.strings[function]);
+    fputc('}', chrome->file);
+}
+
+void wimps_chrome_end(wimps_chrome* const chrome, const int32_t thread, const int64_t time) {
+    fprintf(chrome->file, ",\n{\"ph\":\"E\",\"pid\":%" PRId32 ",\"tid\":%" PRId32 ",\"ts\":%.3f}",
+            chrome->pid, thread, time / 1e3);
+}
+
+// closes the innermost frames of thread until only keep are left open
+void wimps_chrome_close_frames(wimps_chrome* const chrome, wimps_chrome_thread* const thread, const size_t keep, const int64_t time) {
+    while(thread->count > keep) {
+        wimps_chrome_end(chrome, thread->thread, time);
+        thread->count -= 1;
+    }
+}
+
+ErrorCode wimps_chrome_find_thread(wimps_chrome* const chrome, const int32_t thread, wimps_chrome_thread** const outThread) {
+    // there usually aren't many threads, and samples from the same one tend to come in runs
+    for(size_t i = chrome->threadCount; i > 0; --i) {
+        if(chrome->threads[i - 1].thread == thread) {
+            *outThread = &chrome->threads[i - 1];
+            return WIMPS_ERROR_NONE;
+        }
+    }
+
+    wimps_chrome_thread* const threads = realloc(chrome->threads, (chrome->threadCount + 1) * sizeof(wimps_chrome_thread));
+    if(threads == NULL) {
+        return WIMPS_ERROR_REALLOC_FAILED;
+    }
+
+    chrome->threads = threads;
+    *outThread = &chrome->threads[chrome->threadCount];
+    chrome->threadCount += 1;
+
+    **outThread = (wimps_chrome_thread) { thread, NULL, 0, 0, 0 };
+    return WIMPS_ERROR_NONE;
+}
+
+ErrorCode wimps_chrome_start(wimps_chrome* const chrome, const wimps_trace* const trace, const wimps_sample* const sample) {
+    chrome->started = true;
+    chrome->origin = sample->time;
+    chrome->pid = trace->pid;
+
+    fprintf(chrome->file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(chrome->file, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%" PRId32 ",\"args\":{\"name\":", chrome->pid);
+    wimps_chrome_print_string(chrome->file, trace->program);
+    fprintf(chrome->file, "}}");
+
+    return ferror(chrome->file) ? WIMPS_ERROR_WRITE_FAILED : WIMPS_ERROR_NONE;
+}
+
+// a wimps_sample_callback, context is the wimps_chrome
+ErrorCode wimps_chrome_add_sample(const wimps_trace* const trace, const wimps_sample* const sample, void* const context) {
+    wimps_chrome* const chrome = context;
+    ErrorCode error;
+
+    if(trace->aggregated) {
+        // count mode doesn't keep the time of anything
+        return WIMPS_ERROR_NO_TIMELINE;
+    }
+
+    if(! chrome->started) {
+        error = wimps_chrome_start(chrome, trace, sample);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+    }
+
+    // backtrace gives the innermost frame first, flame charts want the outermost first
+    const size_t depth = sample->symbolCount;
+
+    if(depth > chrome->frameCapacity) {
+        size_t* const frames = realloc(chrome->frames, depth * sizeof(size_t));
+        if(frames == NULL) {
+            return WIMPS_ERROR_REALLOC_FAILED;
+        }
+
+        chrome->frames = frames;
+        chrome->frameCapacity = depth;
+    }
+
+    for(size_t i = 0; i < depth; ++i) {
+        size_t keyLength;
+
+        if(   (error = wimps_symbol_function_key(sample->symbols[sample->symbolCount - 1 - i], &chrome->key, &chrome->keySize, &keyLength)) != WIMPS_ERROR_NONE
+           || (error = wimps_string_table_intern(&chrome->functions, chrome->key, keyLength, &chrome->frames[i])) != WIMPS_ERROR_NONE) {
+            return error;
+        }
+    }
+
+    wimps_chrome_thread* thread;
+    error = wimps_chrome_find_thread(chrome, sample->thread, &thread);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    // the sample stands for the interval leading up to it
+    const int64_t end = (sample->time.seconds - chrome->origin.seconds) * 1000000000LL
+                      + (sample->time.nanoseconds - chrome->origin.nanoseconds);
+    int64_t begin = end - (int64_t) sample->weight;
+
+    // only carry frames on from the last sample on this thread if it ended (about) when this one begins,
+    // otherwise the thread wasn't sampled in between and we don't know what it was doing
+    size_t keep = 0;
+
+    if(thread->count > 0 && begin <= thread->end + (int64_t) sample->weight / 2) {
+        while(keep < thread->count && keep < depth && thread->frames[keep] == chrome->frames[keep]) {
+            keep += 1;
+        }
+
+        begin = thread->end;
+    }
+
+    if(begin < thread->end) {
+        // events on a thread have to be in order
+        begin = thread->end;
+    }
+
+    wimps_chrome_close_frames(chrome, thread, keep, thread->end);
+
+    if(depth > thread->capacity) {
+        size_t* const frames = realloc(thread->frames, depth * sizeof(size_t));
+        if(frames == NULL) {
+            return WIMPS_ERROR_REALLOC_FAILED;
+        }
+
+        thread->frames = frames;
+        thread->capacity = depth;
+    }
+
+    for(size_t i = keep; i < depth; ++i) {
+        wimps_chrome_begin(chrome, thread->thread, chrome->frames[i], begin);
+        thread->frames[i] = chrome->frames[i];
+    }
+
+    thread->count = depth;
+    thread->end = end;
+
+    return ferror(chrome->file) ? WIMPS_ERROR_WRITE_FAILED : WIMPS_ERROR_NONE;
+}
+
+// closes every frame that's still open and the file
+ErrorCode wimps_chrome_finish(wimps_chrome* const chrome) {
+    if(chrome->started) {
+        for(size_t i = 0; i < chrome->threadCount; ++i) {
+            wimps_chrome_close_frames(chrome, &chrome->threads[i], 0, chrome->threads[i].end);
+        }
+
+        fprintf(chrome->file, "\n]}\n");
+    } else {
+        fprintf(chrome->file, "{\"traceEvents\":[]}\n");
+    }
+
+    const bool failed = ferror(chrome->file) != 0;
+
+    if(fclose(chrome->file) != 0 || failed) {
+        chrome->file = NULL;
+        return WIMPS_ERROR_WRITE_FAILED;
+    }
+
+    chrome->file = NULL;
+    return WIMPS_ERROR_NONE;
+}
+
+void wimps_chrome_free(wimps_chrome* const chrome) {
+    if(chrome->file != NULL) {
+        fclose(chrome->file);
+    }
+
+    for(size_t i = 0; i < chrome->threadCount; ++i) {
+        free(chrome->threads[i].frames);
+    }
+
+    free(chrome->threads);
+    free(chrome->frames);
+    free(chrome->key);
+    wimps_string_table_free(&chrome->functions);
+}
@@ -0,0 +1,485 @@
+/*
+    This file is part of wimps.
+
+    wimps is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    wimps is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with wimps.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "error_codes.h"
+#include "wimps_read.h"
+#include "wimps_symbols.h"
+
+// Writes the trace as a gzipped pprof profile, see
+// https://github.com/google/pprof/blob/main/proto/profile.proto
+//
+// Protobuf doesn't care what order fields come in, and repeated fields are just appended to,
+// so each function / location / mapping / string is written the first time a sample uses it
+// and each sample is written as soon as it's read. The only things kept in memory are
+// the tables of what's already been written, not the samples themselves.
+//
+// Every sample has two values: how many times it was seen and how much (wall clock) time it stands for.
+
+// Profile field numbers
+#define WIMPS_PPROF_SAMPLE_TYPE    1
+#define WIMPS_PPROF_SAMPLE         2
+#define WIMPS_PPROF_MAPPING        3
+#define WIMPS_PPROF_LOCATION       4
+#define WIMPS_PPROF_FUNCTION       5
+#define WIMPS_PPROF_STRING_TABLE   6
+#define WIMPS_PPROF_TIME_NANOS     9
+#define WIMPS_PPROF_DURATION_NANOS 10
+#define WIMPS_PPROF_PERIOD_TYPE    11
+#define WIMPS_PPROF_PERIOD         12
+
+// protobuf wire types
+#define WIMPS_PROTO_VARINT 0
+#define WIMPS_PROTO_BYTES  2
+
+typedef struct _wimps_proto_buffer {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    // set if an allocation ever fails, so that callers only have to check once they're done
+    bool failed;
+} wimps_proto_buffer;
+
+void wimps_proto_append(wimps_proto_buffer* const buffer, const void* const data, const size_t size) {
+    if(buffer->failed) {
+        return;
+    }
+
+    if(buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+        while(buffer->size + size > capacity) {
+            capacity *= 2;
+        }
+
+        uint8_t* const newData = realloc(buffer->data, capacity);
+        if(newData == NULL) {
+            buffer->failed = true;
+            return;
+        }
+
+        buffer->data = newData;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(&buffer->data[buffer->size], data, size);
+    buffer->size += size;
+}
+
+void wimps_proto_varint(wimps_proto_buffer* const buffer, uint64_t value) {
+    uint8_t bytes[10];
+    size_t count = 0;
+
+    do {
+        bytes[count] = value & 0x7f;
+        value >>= 7;
+
+        if(value != 0) {
+            bytes[count] |= 0x80;
+        }
+
+        count += 1;
+    } while(value != 0);
+
+    wimps_proto_append(buffer, bytes, count);
+}
+
+void wimps_proto_tag(wimps_proto_buffer* const buffer, const uint32_t field, const uint32_t wireType) {
+    wimps_proto_varint(buffer, (field << 3) | wireType);
+}
+
+void wimps_proto_uint(wimps_proto_buffer* const buffer, const uint32_t field, const uint64_t value) {
+    wimps_proto_tag(buffer, field, WIMPS_PROTO_VARINT);
+    wimps_proto_varint(buffer, value);
+}
+
+void wimps_proto_bytes(wimps_proto_buffer* const buffer, const uint32_t field, const void* const data, const size_t size) {
+    wimps_proto_tag(buffer, field, WIMPS_PROTO_BYTES);
+    wimps_proto_varint(buffer, size);
+    wimps_proto_append(buffer, data, size);
+}
+
+void wimps_proto_message(wimps_proto_buffer* const buffer, const uint32_t field, const wimps_proto_buffer* const message) {
+    if(message->failed) {
+        buffer->failed = true;
+        return;
+    }
+
+    wimps_proto_bytes(buffer, field, message->data, message->size);
+}
+
+void wimps_proto_clear(wimps_proto_buffer* const buffer) {
+    buffer->size = 0;
+    buffer->failed = false;
+}
+
+typedef struct _wimps_pprof {
+    gzFile file;
+    bool started;
+
+    // pprof ids are the index in these, plus one (except strings, which start at 0 with "")
+    wimps_string_table strings;
+    wimps_string_table mappings;
+    // keyed by wimps_symbol_function_key
+    wimps_string_table functions;
+    wimps_string_table locations;
+
+    // scratch space for building messages
+    wimps_proto_buffer message;
+    wimps_proto_buffer inner;
+    wimps_proto_buffer packed;
+    // scratch space for wimps_symbol_function_key
+    char* key;
+    size_t keySize;
+
+    bool hasTimes;
+    wimps_timespec first;
+    wimps_timespec last;
+} wimps_pprof;
+
+ErrorCode wimps_pprof_open(wimps_pprof* const pprof, const char* const path) {
+    memset(pprof, 0, sizeof(*pprof));
+
+    pprof->file = gzopen(path, "wb");
+    if(pprof->file == NULL) {
+        return WIMPS_ERROR_CREATE_OUTPUT_FILE_FAILED;
+    }
+
+    return WIMPS_ERROR_NONE;
+}
+
+// writes a single top level field of the profile out
+ErrorCode wimps_pprof_write(wimps_pprof* const pprof, const uint32_t field, const uint32_t wireType, const wimps_proto_buffer* const payload) {
+    if(payload->failed) {
+        return WIMPS_ERROR_REALLOC_FAILED;
+    }
+
+    wimps_proto_buffer header = { NULL, 0, 0, false };
+    uint8_t storage[32];
+    header.data = storage;
+    header.capacity = sizeof(storage);
+
+    wimps_proto_tag(&header, field, wireType);
+    if(wireType == WIMPS_PROTO_BYTES) {
+        wimps_proto_varint(&header, payload->size);
+    }
+
+    if(   gzwrite(pprof->file, header.data, header.size) != (int) header.size
+       || (payload->size > 0 && gzwrite(pprof->file, payload->data, payload->size) != (int) payload->size)) {
+        return WIMPS_ERROR_WRITE_FAILED;
+    }
+
+    return WIMPS_ERROR_NONE;
+}
+
+ErrorCode wimps_pprof_write_uint(wimps_pprof* const pprof, const uint32_t field, const uint64_t value) {
+    wimps_proto_clear(&pprof->message);
+    wimps_proto_varint(&pprof->message, value);
+
+    return wimps_pprof_write(pprof, field, WIMPS_PROTO_VARINT, &pprof->message);
+}
+
+// the index of string in the string table, writing it out if it's new
+ErrorCode wimps_pprof_string(wimps_pprof* const pprof, const char* const string, const size_t length, uint64_t* const outIndex) {
+    const size_t count = pprof->strings.count;
+    size_t id;
+
+    ErrorCode error = wimps_string_table_intern(&pprof->strings, string, length, &id);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    *outIndex = id;
+
+    if(pprof->strings.count == count) {
+        return WIMPS_ERROR_NONE;
+    }
+
+    wimps_proto_clear(&pprof->message);
+    wimps_proto_append(&pprof->message, string, length);
+
+    return wimps_pprof_write(pprof, WIMPS_PPROF_STRING_TABLE, WIMPS_PROTO_BYTES, &pprof->message);
+}
+
+ErrorCode wimps_pprof_value_type(wimps_pprof* const pprof, const uint32_t field, const char* const type, const char* const unit) {
+    uint64_t typeIndex;
+    uint64_t unitIndex;
+
+    ErrorCode error;
+    if(   (error = wimps_pprof_string(pprof, type, strlen(type), &typeIndex)) != WIMPS_ERROR_NONE
+       || (error = wimps_pprof_string(pprof, unit, strlen(unit), &unitIndex)) != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    wimps_proto_clear(&pprof->message);
+    wimps_proto_uint(&pprof->message, 1 /* type */, typeIndex);
+    wimps_proto_uint(&pprof->message, 2 /* unit */, unitIndex);
+
+    return wimps_pprof_write(pprof, field, WIMPS_PROTO_BYTES, &pprof->message);
+}
+
+ErrorCode wimps_pprof_start(wimps_pprof* const pprof, const wimps_trace* const trace) {
+    pprof->started = true;
+
+    // the first entry in the string table must be ""
+    uint64_t empty;
+    ErrorCode error;
+
+    if(   (error = wimps_pprof_string(pprof, "", 0, &empty)) != WIMPS_ERROR_NONE
+       || (error = wimps_pprof_value_type(pprof, WIMPS_PPROF_SAMPLE_TYPE, "samples", "count")) != WIMPS_ERROR_NONE
+       || (error = wimps_pprof_value_type(pprof, WIMPS_PPROF_SAMPLE_TYPE, "wall", "nanoseconds")) != WIMPS_ERROR_NONE
+       || (error = wimps_pprof_value_type(pprof, WIMPS_PPROF_PERIOD_TYPE, "wall", "nanoseconds")) != WIMPS_ERROR_NONE
+       || (error = wimps_pprof_write_uint(pprof, WIMPS_PPROF_PERIOD, trace->initialInterval)) != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    if(trace->startTime != 0) {
+        return wimps_pprof_write_uint(pprof, WIMPS_PPROF_TIME_NANOS, trace->startTime * 1000000000ULL);
+    }
+
+    return WIMPS_ERROR_NONE;
+}
+
+ErrorCode wimps_pprof_mapping(wimps_pprof* const pprof, const char* const module, const size_t moduleLength, uint64_t* const outId) {
+    const size_t count = pprof->mappings.count;
+    size_t id;
+
+    ErrorCode error = wimps_string_table_intern(&pprof->mappings, module, moduleLength, &id);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    *outId = id + 1;
+
+    if(pprof->mappings.count == count) {
+        return WIMPS_ERROR_NONE;
+    }
+
+    uint64_t filename;
+    error = wimps_pprof_string(pprof, module, moduleLength, &filename);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    // backtrace_symbols doesn't say where modules were loaded, only what's in them
+    wimps_proto_clear(&pprof->message);
+    wimps_proto_uint(&pprof->message, 1 /* id */, *outId);
+    wimps_proto_uint(&pprof->message, 5 /* filename */, filename);
+    wimps_proto_uint(&pprof->message, 7 /* has_functions */, 1);
+
+    return wimps_pprof_write(pprof, WIMPS_PPROF_MAPPING, WIMPS_PROTO_BYTES, &pprof->message);
+}
+
+ErrorCode wimps_pprof_function(wimps_pprof* const pprof, const char* const symbol, uint64_t* const outId) {
+    const size_t count = pprof->functions.count;
+    size_t keyLength;
+    size_t id;
+
+    ErrorCode error;
+    if(   (error = wimps_symbol_function_key(symbol, &pprof->key, &pprof->keySize, &keyLength)) != WIMPS_ERROR_NONE
+       || (error = wimps_string_table_intern(&pprof->functions, pprof->key, keyLength, &id)) != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    *outId = id + 1;
+
+    if(pprof->functions.count == count) {
+        return WIMPS_ERROR_NONE;
+    }
+
+    const char* module;
+    size_t moduleLength;
+    wimps_symbol_module(symbol, &module, &moduleLength);
+
+    const char* name;
+    size_t nameLength;
+    wimps_symbol_function(symbol, &name, &nameLength);
+
+    uint64_t nameIndex;
+    uint64_t filename;
+
+    if(   (error = wimps_pprof_string(pprof, name, nameLength, &nameIndex)) != WIMPS_ERROR_NONE
+       || (error = wimps_pprof_string(pprof, module, moduleLength, &filename)) != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    wimps_proto_clear(&pprof->message);
+    wimps_proto_uint(&pprof->message, 1 /* id */, *outId);
+    wimps_proto_uint(&pprof->message, 2 /* name */, nameIndex);
+    wimps_proto_uint(&pprof->message, 3 /* system_name */, nameIndex);
+    wimps_proto_uint(&pprof->message, 4 /* filename */, filename);
+
+    return wimps_pprof_write(pprof, WIMPS_PPROF_FUNCTION, WIMPS_PROTO_BYTES, &pprof->message);
+}
+
+// one location per distinct backtrace_symbols line
+ErrorCode wimps_pprof_location(wimps_pprof* const pprof, const char* const symbol, uint64_t* const outId) {
+    const size_t count = pprof->locations.count;
+    size_t id;
+
+    ErrorCode error = wimps_string_table_intern(&pprof->locations, symbol, strlen(symbol), &id);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    *outId = id + 1;
+
+    if(pprof->locations.count == count) {
+        return WIMPS_ERROR_NONE;
+    }
+
+    const char* module;
+    size_t moduleLength;
+    wimps_symbol_module(symbol, &module, &moduleLength);
+
+    uint64_t mapping = 0;
+    uint64_t function;
+
+    if(moduleLength > 0) {
+        error = wimps_pprof_mapping(pprof, module, moduleLength, &mapping);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+    }
+
+    error = wimps_pprof_function(pprof, symbol, &function);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    wimps_proto_clear(&pprof->inner);
+    wimps_proto_uint(&pprof->inner, 1 /* function_id */, function);
+
+    wimps_proto_clear(&pprof->message);
+    wimps_proto_uint(&pprof->message, 1 /* id */, *outId);
+
+    if(mapping != 0) {
+        wimps_proto_uint(&pprof->message, 2 /* mapping_id */, mapping);
+    }
+
+    wimps_proto_uint(&pprof->message, 3 /* address */, wimps_symbol_address(symbol));
+    wimps_proto_message(&pprof->message, 4 /* line */, &pprof->inner);
+
+    return wimps_pprof_write(pprof, WIMPS_PPROF_LOCATION, WIMPS_PROTO_BYTES, &pprof->message);
+}
+
+// a wimps_sample_callback, context is the wimps_pprof
+ErrorCode wimps_pprof_add_sample(const wimps_trace* const trace, const wimps_sample* const sample, void* const context) {
+    wimps_pprof* const pprof = context;
+    ErrorCode error;
+
+    if(! pprof->started) {
+        error = wimps_pprof_start(pprof, trace);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+    }
+
+    if(! trace->aggregated) {
+        if(! pprof->hasTimes) {
+            pprof->first = sample->time;
+            pprof->hasTimes = true;
+        }
+
+        pprof->last = sample->time;
+    }
+
+    // pprof wants the innermost frame first, which is the order backtrace gives them in
+    wimps_proto_clear(&pprof->packed);
+
+    for(size_t i = 0; i < sample->symbolCount; ++i) {
+        uint64_t location;
+
+        error = wimps_pprof_location(pprof, sample->symbols[i], &location);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+
+        wimps_proto_varint(&pprof->packed, location);
+    }
+
+    uint64_t threadKey = 0;
+    if(sample->thread != 0) {
+        error = wimps_pprof_string(pprof, "thread", strlen("thread"), &threadKey);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+    }
+
+    wimps_proto_clear(&pprof->message);
+    wimps_proto_message(&pprof->message, 1 /* location_id, packed */, &pprof->packed);
+
+    wimps_proto_clear(&pprof->inner);
+    wimps_proto_varint(&pprof->inner, sample->count);
+    wimps_proto_varint(&pprof->inner, sample->weight);
+    wimps_proto_message(&pprof->message, 2 /* value, packed */, &pprof->inner);
+
+    if(sample->thread != 0) {
+        wimps_proto_clear(&pprof->inner);
+        wimps_proto_uint(&pprof->inner, 1 /* key */, threadKey);
+        wimps_proto_uint(&pprof->inner, 3 /* num */, sample->thread);
+        wimps_proto_message(&pprof->message, 3 /* label */, &pprof->inner);
+    }
+
+    return wimps_pprof_write(pprof, WIMPS_PPROF_SAMPLE, WIMPS_PROTO_BYTES, &pprof->message);
+}
+
+// writes out anything that could only be known at the end and closes the file
+ErrorCode wimps_pprof_finish(wimps_pprof* const pprof, const wimps_trace* const trace) {
+    ErrorCode error = WIMPS_ERROR_NONE;
+
+    if(! pprof->started) {
+        error = wimps_pprof_start(pprof, trace);
+    }
+
+    if(error == WIMPS_ERROR_NONE && pprof->hasTimes) {
+        const int64_t duration = (pprof->last.seconds - pprof->first.seconds) * 1000000000LL
+                               + (pprof->last.nanoseconds - pprof->first.nanoseconds);
+
+        error = wimps_pprof_write_uint(pprof, WIMPS_PPROF_DURATION_NANOS, duration);
+    }
+
+    if(gzclose(pprof->file) != Z_OK && error == WIMPS_ERROR_NONE) {
+        error = WIMPS_ERROR_WRITE_FAILED;
+    }
+
+    pprof->file = NULL;
+    return error;
+}
+
+void wimps_pprof_free(wimps_pprof* const pprof) {
+    if(pprof->file != NULL) {
+        gzclose(pprof->file);
+    }
+
+    wimps_string_table_free(&pprof->strings);
+    wimps_string_table_free(&pprof->mappings);
+    wimps_string_table_free(&pprof->functions);
+    wimps_string_table_free(&pprof->locations);
+
+    free(pprof->message.data);
+    free(pprof->inner.data);
+    free(pprof->packed.data);
+    free(pprof->key);
+}
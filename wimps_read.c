@@ -16,38 +16,29 @@
 */
 
 #include "wimps_read.h"
+#include "wimps_timeline.h"
+#include "wimps_pprof.h"
+#include "wimps_chrome.h"
 
 #include <unistd.h>
 #include <stdbool.h>
-#include <linux/limits.h>
 #include <stdio.h>
-#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <getopt.h>
 
-ErrorCode wimps_read(const int fd, void* out, ssize_t bytes) {
-    while(bytes > 0) {
-        const ssize_t readBytes = read(fd, out, bytes);
-
-        if(readBytes == -1) {
-            // something went wrong!
-            return WIMPS_ERROR_READ_FAILED;
-        }
-
-        if(readBytes == 0) {
-            return WIMPS_ERROR_EOF;
-        }
-
-        out += readBytes;
-        bytes -= readBytes;
+ErrorCode wimps_read(FILE* const file, void* out, const size_t bytes) {
+    if(fread(out, 1, bytes, file) != bytes) {
+        return feof(file) ? WIMPS_ERROR_EOF : WIMPS_ERROR_READ_FAILED;
     }
 
     return WIMPS_ERROR_NONE;
 }
 
-ErrorCode wimps_check_marker_char(int fd, char expected) {
+ErrorCode wimps_check_marker_char(FILE* const file, char expected) {
     char actual;
-    const ErrorCode error = wimps_read(fd, &actual, 1);
+    const ErrorCode error = wimps_read(file, &actual, 1);
     _Static_assert(sizeof(char) == 1, "Assumed sizeof(char) was 1...it's not");
 
     if(error != WIMPS_ERROR_NONE) {
@@ -57,199 +48,488 @@ ErrorCode wimps_check_marker_char(int fd, char expected) {
     return actual == expected ? WIMPS_ERROR_NONE : WIMPS_ERROR_BAD_MARKER;
 }
 
-ErrorCode wimps_readline(int fd, char* buffer, const size_t bufferSize) {
-    char* bufferNext = buffer;
-    size_t bufferSizeLeft = bufferSize;
+// reads up to and including the next newline into *buffer, growing it as needed (see getline)
+ErrorCode wimps_readline(FILE* const file, char** const buffer, size_t* const bufferSize, size_t* const outLength) {
+    const ssize_t length = getline(buffer, bufferSize, file);
 
-    while(true) {
-        const ErrorCode error = wimps_read(fd, bufferNext, 1);
+    if(length == -1) {
+        return feof(file) ? WIMPS_ERROR_EOF : WIMPS_ERROR_READ_FAILED;
+    }
 
-        if(error != WIMPS_ERROR_NONE) {
-            return error;
+    *outLength = length;
+    return WIMPS_ERROR_NONE;
+}
+
+// the symbols of the sample currently being read.
+// The memory is reused from one sample to the next, so that reading a trace
+// only ever needs enough memory for its largest sample.
+typedef struct _wimps_symbol_buffer {
+    // each symbol one after the other, null terminated
+    char* data;
+    size_t dataSize;
+    size_t dataCapacity;
+
+    // where each symbol starts in data
+    size_t* offsets;
+    const char** symbols;
+    size_t count;
+    size_t capacity;
+} wimps_symbol_buffer;
+
+ErrorCode wimps_symbol_buffer_push(wimps_symbol_buffer* const buffer, const char* const symbol, const size_t length) {
+    if(buffer->dataSize + length + 1 > buffer->dataCapacity) {
+        size_t capacity = buffer->dataCapacity == 0 ? 4096 : buffer->dataCapacity;
+        while(buffer->dataSize + length + 1 > capacity) {
+            capacity *= 2;
         }
 
-        if(*bufferNext == '\n') {
-            break;
+        char* const data = realloc(buffer->data, capacity);
+        if(data == NULL) {
+            return WIMPS_ERROR_REALLOC_FAILED;
+        }
+
+        buffer->data = data;
+        buffer->dataCapacity = capacity;
+    }
+
+    if(buffer->count == buffer->capacity) {
+        const size_t capacity = buffer->capacity == 0 ? 64 : buffer->capacity * 2;
+
+        size_t* const offsets = realloc(buffer->offsets, capacity * sizeof(size_t));
+        if(offsets == NULL) {
+            return WIMPS_ERROR_REALLOC_FAILED;
+        }
+
+        buffer->offsets = offsets;
+
+        const char** const symbols = realloc(buffer->symbols, capacity * sizeof(char*));
+        if(symbols == NULL) {
+            return WIMPS_ERROR_REALLOC_FAILED;
         }
 
-        bufferNext += 1;
-        bufferSizeLeft -= 1;
+        buffer->symbols = symbols;
+        buffer->capacity = capacity;
     }
 
+    memcpy(&buffer->data[buffer->dataSize], symbol, length);
+    buffer->data[buffer->dataSize + length] = '\0';
+
+    buffer->offsets[buffer->count] = buffer->dataSize;
+    buffer->count += 1;
+    buffer->dataSize += length + 1;
+
     return WIMPS_ERROR_NONE;
 }
 
-ErrorCode wimps_read_trace(const int fd, wimps_trace* const out) {
-    if(out == NULL) {
+// data can move while symbols are being pushed, so the pointers are only filled in once they're all there
+void wimps_symbol_buffer_finish(wimps_symbol_buffer* const buffer) {
+    for(size_t i = 0; i < buffer->count; ++i) {
+        buffer->symbols[i] = &buffer->data[buffer->offsets[i]];
+    }
+}
+
+// reads the trace one record at a time, calling callback for every sample.
+// Nothing is kept around once the callback returns, so this works for traces of any size.
+ErrorCode wimps_read_trace(FILE* const file, wimps_trace* const out, wimps_sample_callback callback, void* const context) {
+    if(out == NULL || callback == NULL) {
         return WIMPS_ERROR_NULL_ARG;
     }
 
-    // we use realloc later...
-    // if this isn't null, one of the following has happened:
-    // (1) the caller just didn't zero the memory
-    // (2) the caller is reusing it
-    // we assume (1). (2) is a memory leak.
-    out->samples = NULL;
-    out->sampleCount = 0;
+    out->aggregated = false;
+    out->truncated = false;
+    out->initialInterval = wimps_default_interval;
+    out->pid = 0;
+    out->startTime = 0;
+    out->program[0] = '\0';
 
-    if(fd == -1) {
+    if(file == NULL) {
         return WIMPS_ERROR_BAD_FILE;
     }
 
-    char buffer[PATH_MAX] = { '\0' };
+    char* line = NULL;
+    size_t lineSize = 0;
+    size_t lineLength = 0;
 
-    {
-        char* bufferNext = buffer;
-        const size_t bufferSize = sizeof(buffer) / sizeof(buffer[0]);
-        size_t bufferSizeLeft = bufferSize;
+    wimps_symbol_buffer symbols = { NULL, 0, 0, NULL, NULL, 0, 0 };
 
-        // TODO: this should probably go into a wimps_readline or something,
-        //       or find some standard C function that takes an fd / convert it to FILE*
-        while(true) {
-            const ErrorCode error = wimps_read(fd, bufferNext, 1);
+    ErrorCode error = wimps_readline(file, &line, &lineSize, &lineLength);
+    if(error != WIMPS_ERROR_NONE) {
+        goto wimps_read_trace_exit;
+    }
 
-            if(error != WIMPS_ERROR_NONE) {
-                return error;
-            }
+    // v1 traces don't record the sampling interval (it was always the default) or the thread
+    bool v1 = false;
 
-            if(*bufferNext == '\n') {
-                break;
-            }
+    if(strncmp(line, wimps_counts_marker_v1, wimps_counts_marker_v1_strlen) == 0) {
+        out->aggregated = true;
+    } else if(strncmp(line, wimps_trace_marker_v1, wimps_trace_marker_v1_strlen) == 0) {
+        v1 = true;
+    } else if(strncmp(line, wimps_trace_marker_v2, wimps_trace_marker_v2_strlen) != 0) {
+        error = WIMPS_ERROR_UNKNOWN_FORMAT;
+        goto wimps_read_trace_exit;
+    }
 
-            bufferNext += 1;
-            bufferSizeLeft -= 1;
+    // the rest of the header is "_pid<pid>_time<seconds>_<program>_" (see wimps_create_trace_file)
+    {
+        const char* const details = strstr(line, "_pid");
+        int consumed = 0;
+
+        if(   details != NULL
+           && sscanf(details, "_pid%" SCNd32 "_time%" SCNd64 "_%n", &out->pid, &out->startTime, &consumed) == 2
+           && consumed > 0) {
+            const char* const program = details + consumed;
+            const char* const programEnd = strrchr(program, '_');
+
+            if(programEnd != NULL && (size_t) (programEnd - program) < sizeof(out->program)) {
+                memcpy(out->program, program, programEnd - program);
+                out->program[programEnd - program] = '\0';
+            }
         }
     }
 
-    if(strncmp(buffer, wimps_trace_marker_v1, wimps_trace_marker_v1_strlen) != 0) {
-        return WIMPS_ERROR_UNKNOWN_FORMAT;
-    }
+    int64_t currentInterval = out->initialInterval;
+    bool seenInterval = false;
 
     while(true) {
-        // get marker "a"
+        // get marker "a" (a sample) or "r" (an interval change)
         // it's ok to fail if it's EOF (i.e. no more samples)
-        {
-            const ErrorCode error = wimps_check_marker_char(fd, 'a');
-            if(error != WIMPS_ERROR_NONE) {
-                if(error == WIMPS_ERROR_EOF) {
-                    break;
-                }
-            }
+        char recordType;
+
+        error = wimps_read(file, &recordType, 1);
+        if(error == WIMPS_ERROR_EOF) {
+            error = WIMPS_ERROR_NONE;
+            break;
+        }
+
+        if(error != WIMPS_ERROR_NONE) {
+            break;
         }
 
-        // make room for one more sample
-        // it's incremented at the end when we know the sample is at least probably valid
-        // TODO: clean up memory on later failure
-        {
-            wimps_sample* newSamples = realloc(out->samples,
-                                               (out->sampleCount + 1) * sizeof(wimps_sample));
+        if(recordType == 'r' && ! v1 && ! out->aggregated) {
+            wimps_timespec changeTime;
 
-            if(newSamples == NULL) {
-                return WIMPS_ERROR_REALLOC_FAILED;
+            if(! (   (error = wimps_read(file, &changeTime, sizeof(changeTime))) == WIMPS_ERROR_NONE
+                  && (error = wimps_read(file, &currentInterval, sizeof(currentInterval))) == WIMPS_ERROR_NONE
+                  && (error = wimps_check_marker_char(file, 'c')) == WIMPS_ERROR_NONE)) {
+                break;
             }
 
-            out->samples = newSamples;
-        }
+            if(! seenInterval) {
+                out->initialInterval = currentInterval;
+                seenInterval = true;
+            }
 
-        wimps_sample* const currentSample = &out->samples[out->sampleCount];
-        out->sampleCount += 1;
+            continue;
+        }
 
-        // get the time of sample
-        {
-           const ErrorCode error = wimps_read(fd,
-                                              &currentSample->time,
-                                              sizeof(currentSample->time));
+        if(recordType != 'a') {
+            error = WIMPS_ERROR_BAD_MARKER;
+            break;
+        }
 
+        wimps_sample sample = {
+            .time = { 0, 0 },
+            .symbols = NULL,
+            .symbolCount = 0,
+            .count = 1,
+            .weight = currentInterval,
+            .thread = 0
+        };
+
+        // get the time of sample, or how many times it was seen for count mode
+        if(out->aggregated) {
+            if(! (   (error = wimps_read(file, &sample.count, sizeof(sample.count))) == WIMPS_ERROR_NONE
+                  && (error = wimps_read(file, &sample.weight, sizeof(sample.weight))) == WIMPS_ERROR_NONE)) {
+                break;
+            }
+        } else {
+            error = wimps_read(file, &sample.time, sizeof(sample.time));
             if(error != WIMPS_ERROR_NONE) {
-                return error;
+                break;
+            }
+
+            if(! v1) {
+                error = wimps_read(file, &sample.thread, sizeof(sample.thread));
+                if(error != WIMPS_ERROR_NONE) {
+                    break;
+                }
             }
         }
 
         // get marker "b"
-        {
-            const ErrorCode error = wimps_check_marker_char(fd, 'b');
+        error = wimps_check_marker_char(file, 'b');
+        if(error != WIMPS_ERROR_NONE) {
+            break;
+        }
+
+        // get the symbols
+        symbols.dataSize = 0;
+        symbols.count = 0;
+
+        while(true) {
+            error = wimps_readline(file, &line, &lineSize, &lineLength);
+            if(error != WIMPS_ERROR_NONE) {
+                goto wimps_read_trace_records_end;
+            }
+
+            if(strcmp(line, wimps_end_sample_marker) == 0) {
+                break;
+            }
+
+            // chop off the newline character
+            error = wimps_symbol_buffer_push(&symbols, line, lineLength - 1);
             if(error != WIMPS_ERROR_NONE) {
-                return error;
+                goto wimps_read_trace_records_end;
             }
         }
 
-        // get the symbols
-        {
-            for(size_t i = 0;; ++i) {
-                char strbuffer[1000] = { '\0' };
-                const ErrorCode error = wimps_readline(fd, strbuffer, sizeof(strbuffer) - 1);
+        wimps_symbol_buffer_finish(&symbols);
+        sample.symbols = symbols.symbols;
+        sample.symbolCount = symbols.count;
 
-                if(error != WIMPS_ERROR_NONE) {
-                    return error;
-                }
+        // v1 traces start every sample with wimps' own signal handler and the signal trampoline that called it
+        // (always exactly those two, it was never built with optimisations), newer ones leave them out
+        if(v1 && sample.symbolCount >= 2) {
+            sample.symbols += 2;
+            sample.symbolCount -= 2;
+        }
 
-                if(strncmp(wimps_end_sample_marker, strbuffer, wimps_end_sample_marker_strlen) == 0) {
-                    break;
-                }
+        // get marker "c"
+        error = wimps_check_marker_char(file, 'c');
+        if(error != WIMPS_ERROR_NONE) {
+            break;
+        }
 
-                // chop off the newline character
-                strbuffer[strlen(strbuffer) - 1] = '\0';
+        error = callback(out, &sample, context);
+        if(error != WIMPS_ERROR_NONE) {
+            break;
+        }
+    }
 
-                const char** symbols = realloc(currentSample->symbols, sizeof(char*) * (i + 1));
+wimps_read_trace_records_end:
+    // running out of file part way through a record means the process was killed while writing it
+    // (or is still running); everything before it is fine, so that's the end of the trace
+    if(error == WIMPS_ERROR_EOF) {
+        out->truncated = true;
+        error = WIMPS_ERROR_NONE;
+    }
 
-                if(symbols == NULL) {
-                    return WIMPS_ERROR_REALLOC_FAILED;
-                }
+wimps_read_trace_exit:
+    free(line);
+    free(symbols.data);
+    free(symbols.offsets);
+    free(symbols.symbols);
 
-                const char* const symbol = strndup(strbuffer, sizeof(strbuffer));
+    return error;
+}
 
-                if(symbol == NULL) {
-                    return WIMPS_ERROR_STRNDUP_FAILED;
-                }
+// the default report, every sample and its symbols
+typedef struct _wimps_dump {
+    size_t index;
+    uint64_t totalCount;
+    uint64_t totalWeight;
+} wimps_dump;
 
-                currentSample->symbols = symbols;
-                currentSample->symbols[i] = symbol;
-                currentSample->symbolCount += 1;
-            }
-        }
+// a wimps_sample_callback, context is the wimps_dump
+ErrorCode wimps_dump_sample(const wimps_trace* const trace, const wimps_sample* const sample, void* const context) {
+    wimps_dump* const dump = context;
 
-        // get marker "c"
-        {
-            const ErrorCode error = wimps_check_marker_char(fd, 'c');
-            if(error != WIMPS_ERROR_NONE) {
-                return error;
-            }
+    // the weight is the sampling interval(s) the sample stands for, so it's an estimate of time spent
+    const double seconds = sample->weight / 1e9;
+
+    if(trace->aggregated) {
+        printf("Sample %zu (count %" PRIu64 ", ~%.3fs)\n", dump->index, sample->count, seconds);
+    } else if(sample->thread != 0) {
+        printf("Sample %zu (~%.3fs, thread %" PRId32 ")\n", dump->index, seconds, sample->thread);
+    } else {
+        printf("Sample %zu (~%.3fs)\n", dump->index, seconds);
+    }
+
+    for(size_t i = 0; i < sample->symbolCount; ++i) {
+        printf("\t%s\n", sample->symbols[i]);
+    }
+
+    dump->index += 1;
+    dump->totalCount += sample->count;
+    dump->totalWeight += sample->weight;
+
+    return WIMPS_ERROR_NONE;
+}
+
+// lets more than one report / export share a single pass over the trace
+typedef struct _wimps_report {
+    wimps_sample_callback callback;
+    void* context;
+} wimps_report;
+
+typedef struct _wimps_reports {
+    wimps_report reports[3];
+    size_t count;
+} wimps_reports;
+
+// a wimps_sample_callback, context is the wimps_reports
+ErrorCode wimps_reports_sample(const wimps_trace* const trace, const wimps_sample* const sample, void* const context) {
+    const wimps_reports* const reports = context;
+
+    for(size_t i = 0; i < reports->count; ++i) {
+        const ErrorCode error = reports->reports[i].callback(trace, sample, reports->reports[i].context);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
         }
     }
 
     return WIMPS_ERROR_NONE;
 }
 
+void wimps_print_usage() {
+    fprintf(stderr, "Usage: wimps-read [options] <trace file>\n");
+    fprintf(stderr, "  --timeline[=ms]     show the top functions per interval of ms milliseconds (default 1000),\n");
+    fprintf(stderr, "                      flagging intervals that look very different from the one before\n");
+    fprintf(stderr, "  --top=n             how many functions to show per interval (default 5)\n");
+    fprintf(stderr, "  --threshold=x       how different (0 to 1) an interval has to be to be flagged (default 0.5)\n");
+    fprintf(stderr, "  --pprof=file        write a gzipped pprof profile to file\n");
+    fprintf(stderr, "  --chrome=file       write Chrome trace event JSON (chrome://tracing, Perfetto) to file\n");
+    fprintf(stderr, "Without any of --timeline, --pprof or --chrome every sample is printed.\n");
+}
+
 int main(int argc, char** argv) {
-    if(argv[1] == NULL) {
+    bool timelineReport = false;
+    int64_t timelineInterval = 1000;
+    size_t timelineTop = 5;
+    double timelineThreshold = 0.5;
+    const char* pprofPath = NULL;
+    const char* chromePath = NULL;
+
+    const struct option options[] = {
+        { "timeline",  optional_argument, NULL, 't' },
+        { "top",       required_argument, NULL, 'n' },
+        { "threshold", required_argument, NULL, 'x' },
+        { "pprof",     required_argument, NULL, 'p' },
+        { "chrome",    required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while(true) {
+        const int option = getopt_long(argc, argv, "", options, NULL);
+
+        if(option == -1) {
+            break;
+        }
+
+        switch(option) {
+        case 't':
+            timelineReport = true;
+            if(optarg != NULL) {
+                timelineInterval = strtoll(optarg, NULL, 10);
+            }
+            break;
+        case 'n':
+            timelineTop = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            timelineThreshold = strtod(optarg, NULL);
+            break;
+        case 'p':
+            pprofPath = optarg;
+            break;
+        case 'c':
+            chromePath = optarg;
+            break;
+        default:
+            wimps_print_usage();
+            return WIMPS_ERROR_BAD_ARGS;
+        }
+    }
+
+    if(timelineInterval <= 0) {
+        fprintf(stderr, "The timeline interval must be at least 1ms\n");
+        return WIMPS_ERROR_BAD_ARGS;
+    }
+
+    if(optind >= argc) {
         fprintf(stderr, "Please pass the name of the wimps trace file you want to read\n");
+        wimps_print_usage();
         return WIMPS_ERROR_NO_ARGS;
     }
 
-    int fd = open(argv[1], O_RDONLY);
-    if(fd == -1) {
+    FILE* const file = fopen(argv[optind], "rb");
+    if(file == NULL) {
         fprintf(stderr, "Could not open trace file\n");
         return WIMPS_ERROR_READ_FAILED;
     }
 
-    wimps_trace trace;
-    const ErrorCode error = wimps_read_trace(fd, &trace);
+    wimps_trace trace = { .aggregated = false };
+    ErrorCode error = WIMPS_ERROR_NONE;
+
+    wimps_reports reports = { .count = 0 };
+    wimps_dump dump = { 0, 0, 0 };
+    wimps_timeline timeline;
+    wimps_pprof pprof;
+    wimps_chrome chrome;
+
+    wimps_timeline_init(&timeline, timelineInterval * 1000000, timelineTop, timelineThreshold);
+    memset(&pprof, 0, sizeof(pprof));
+    memset(&chrome, 0, sizeof(chrome));
+
+    if(timelineReport) {
+        reports.reports[reports.count++] = (wimps_report) { &wimps_timeline_add_sample, &timeline };
+    }
+
+    if(pprofPath != NULL) {
+        error = wimps_pprof_open(&pprof, pprofPath);
+        reports.reports[reports.count++] = (wimps_report) { &wimps_pprof_add_sample, &pprof };
+    }
+
+    if(chromePath != NULL && error == WIMPS_ERROR_NONE) {
+        error = wimps_chrome_open(&chrome, chromePath);
+        reports.reports[reports.count++] = (wimps_report) { &wimps_chrome_add_sample, &chrome };
+    }
+
+    if(reports.count == 0) {
+        reports.reports[reports.count++] = (wimps_report) { &wimps_dump_sample, &dump };
+    }
+
+    if(error == WIMPS_ERROR_NONE) {
+        error = wimps_read_trace(file, &trace, &wimps_reports_sample, &reports);
+    }
+
+    if(error == WIMPS_ERROR_NONE && timelineReport) {
+        error = wimps_timeline_finish(&timeline);
+    }
+
+    // the exports are finished off even if the read failed part way through,
+    // so that whatever made it into them is still a valid file
+    if(pprof.file != NULL) {
+        const ErrorCode finishError = wimps_pprof_finish(&pprof, &trace);
+        if(error == WIMPS_ERROR_NONE) {
+            error = finishError;
+        }
+    }
+
+    if(chrome.file != NULL) {
+        const ErrorCode finishError = wimps_chrome_finish(&chrome);
+        if(error == WIMPS_ERROR_NONE) {
+            error = finishError;
+        }
+    }
+
+    if(error == WIMPS_ERROR_NONE && reports.reports[0].callback == &wimps_dump_sample) {
+        printf("Total %" PRIu64 " samples (~%.3fs)\n", dump.totalCount, dump.totalWeight / 1e9);
+    }
+
+    if(trace.truncated) {
+        fprintf(stderr, "WIMPS | WRN | The last record in the trace is incomplete (was the process killed?), ignoring it\n");
+    }
 
     if(error != WIMPS_ERROR_NONE) {
         fprintf(stderr, "%s\n", wimps_error_string(error));
-        fprintf(stderr, "File position %jd\n", lseek(fd, 0, SEEK_CUR));
-    } else {
-        for(size_t i = 0; i < trace.sampleCount; ++i) {
-            printf("Sample %zu\n", i);
-            for(size_t j = 0; j < trace.samples[i].symbolCount; ++j) {
-                printf("\t%s\n", trace.samples[i].symbols[j]);
-            }
-        }
+        fprintf(stderr, "File position %ld\n", ftell(file));
     }
 
-    // TODO: free trace memory? doesn't matter much for now since the program closes after
+    wimps_timeline_free(&timeline);
+    wimps_pprof_free(&pprof);
+    wimps_chrome_free(&chrome);
 
-    close(fd);
+    fclose(file);
     return error;
 }
-
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "error_codes.h"
 
@@ -38,16 +39,53 @@ typedef struct _wimps_sample {
     wimps_timespec time;
     const char** symbols;
     size_t symbolCount;
+    // number of times this stack was seen;
+    // always 1 for full traces, since every sample is written out
+    uint64_t count;
+    // how much run time (in nanoseconds) this sample stands for,
+    // i.e. the sampling interval(s) in effect when it was taken
+    uint64_t weight;
+    // the thread that was sampled, 0 if the trace doesn't say (count mode, or older formats)
+    int32_t thread;
 } wimps_sample;
 
+// everything about a trace apart from the samples,
+// which are handed out one by one as they're read (see wimps_read_trace)
 typedef struct _wimps_trace {
-    wimps_sample* samples;
-    size_t sampleCount;
+    // true if the trace came from count mode,
+    // in which case the sample times are meaningless
+    bool aggregated;
+    // true if the trace ended part way through a record, which was ignored
+    bool truncated;
+    // the sampling interval (in nanoseconds) when the trace started
+    int64_t initialInterval;
+    // from the header line, 0 / empty if it couldn't be parsed
+    int32_t pid;
+    int64_t startTime; // seconds since the epoch
+    char program[256];
 } wimps_trace;
 
+// called for each sample as it's read; the sample (and its symbols) are only valid until it returns.
+// Returning anything other than WIMPS_ERROR_NONE stops the read with that error.
+typedef ErrorCode (*wimps_sample_callback)(const wimps_trace* trace, const wimps_sample* sample, void* context);
+
+// the sampling interval used by traces that don't record it (v1),
+// and by libpreload.so when there's no overhead budget to adapt to
+const int64_t wimps_default_interval = 200000000;
+
 const char wimps_trace_marker_v1[] = "_wimps_trace_v1";
 const size_t wimps_trace_marker_v1_strlen = sizeof(wimps_trace_marker_v1) / sizeof(wimps_trace_marker_v1[0]) - 1 /* null terminator */;
 
+// v2 adds "r" records whenever the sampling interval changes (and one at the start),
+// and the id of the thread that was sampled after the time of each sample
+const char wimps_trace_marker_v2[] = "_wimps_trace_v2";
+const size_t wimps_trace_marker_v2_strlen = sizeof(wimps_trace_marker_v2) / sizeof(wimps_trace_marker_v2[0]) - 1 /* null terminator */;
+
+// count mode traces only contain each unique stack once, along with how often it was seen
+// and its total weight (since the sampling interval can change)
+const char wimps_counts_marker_v1[] = "_wimps_counts_v1";
+const size_t wimps_counts_marker_v1_strlen = sizeof(wimps_counts_marker_v1) / sizeof(wimps_counts_marker_v1[0]) - 1 /* null terminator */;
+
 const char wimps_end_sample_marker[] = "wimps_end_sample\n";
 const size_t wimps_end_sample_marker_strlen = sizeof(wimps_end_sample_marker) / sizeof(wimps_end_sample_marker[0]) - 1;
 
@@ -0,0 +1,224 @@
+/*
+    This file is part of wimps.
+
+    wimps is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    wimps is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with wimps.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error_codes.h"
+
+// Picks the function name out of a backtrace_symbols line, e.g.
+//   "./prog(main+0x23)[0x55c501a97197]" -> "main"
+// Frames without a name, e.g.
+//   "/lib/x86_64-linux-gnu/libc.so.6(+0x2724a)[0x7f0e2b24524a]"
+// are named after the module and offset instead: "/lib/x86_64-linux-gnu/libc.so.6(+0x2724a)".
+//
+// The name isn't copied, outLength says how much of *outStart it is.
+void wimps_symbol_function(const char* const symbol, const char** const outStart, size_t* const outLength) {
+    const char* const open = strchr(symbol, '(');
+    const char* const address = strrchr(symbol, '[');
+
+    if(open != NULL) {
+        const char* const end = strpbrk(open + 1, "+)");
+
+        if(end != NULL && end != open + 1) {
+            *outStart = open + 1;
+            *outLength = end - (open + 1);
+            return;
+        }
+    }
+
+    *outStart = symbol;
+    *outLength = address != NULL ? (size_t) (address - symbol) : strlen(symbol);
+}
+
+// Picks the module out of a backtrace_symbols line, e.g.
+//   "./prog(main+0x23)[0x55c501a97197]" -> "./prog"
+// Empty if there isn't one.
+void wimps_symbol_module(const char* const symbol, const char** const outStart, size_t* const outLength) {
+    const char* const open = strchr(symbol, '(');
+
+    *outStart = symbol;
+    *outLength = open != NULL ? (size_t) (open - symbol) : 0;
+}
+
+// What reports use to tell functions apart (and show them as), since the same name can turn up
+// in more than one module (e.g. static functions): the name followed by the module, e.g.
+//   "./prog(main+0x23)[0x55c501a97197]" -> "main (./prog)"
+// Frames without a name are already named after their module (see wimps_symbol_function), so they're left as they are.
+//
+// *buffer is grown as needed (like getline), the key is null terminated and outLength is how long it is.
+ErrorCode wimps_symbol_function_key(const char* const symbol, char** const buffer, size_t* const bufferSize, size_t* const outLength) {
+    const char* module;
+    size_t moduleLength;
+    wimps_symbol_module(symbol, &module, &moduleLength);
+
+    const char* name;
+    size_t nameLength;
+    wimps_symbol_function(symbol, &name, &nameLength);
+
+    const bool named = name != symbol;
+    const size_t length = named ? nameLength + 2 + moduleLength + 1 : nameLength;
+
+    if(length + 1 > *bufferSize) {
+        char* const newBuffer = realloc(*buffer, length + 1);
+        if(newBuffer == NULL) {
+            return WIMPS_ERROR_REALLOC_FAILED;
+        }
+
+        *buffer = newBuffer;
+        *bufferSize = length + 1;
+    }
+
+    char* key = *buffer;
+
+    memcpy(key, name, nameLength);
+    key += nameLength;
+
+    if(named) {
+        memcpy(key, " (", 2);
+        memcpy(key + 2, module, moduleLength);
+        key[2 + moduleLength] = ')';
+        key += 2 + moduleLength + 1;
+    }
+
+    *key = '\0';
+    *outLength = length;
+
+    return WIMPS_ERROR_NONE;
+}
+
+// Picks the address out of a backtrace_symbols line, e.g.
+//   "./prog(main+0x23)[0x55c501a97197]" -> 0x55c501a97197
+// 0 if there isn't one.
+uint64_t wimps_symbol_address(const char* const symbol) {
+    const char* const address = strrchr(symbol, '[');
+
+    return address != NULL ? strtoull(address + 1, NULL, 16) : 0;
+}
+
+// Hands out a small, dense id for every distinct string it's given,
+// so reports can use arrays instead of comparing strings all the time.
+typedef struct _wimps_string_table {
+    // id -> string, null terminated
+    char** strings;
+    size_t count;
+
+    // open addressing, slot -> id + 1 (0 means empty)
+    size_t* slots;
+    size_t slotCount;
+} wimps_string_table;
+
+// FNV-1a, carrying on from hash so that several strings can be hashed as one
+uint64_t wimps_hash_append(uint64_t hash, const char* const string, const size_t length) {
+    for(size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char) string[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+uint64_t wimps_hash_string(const char* const string, const size_t length) {
+    return wimps_hash_append(14695981039346656037ULL, string, length);
+}
+
+ErrorCode wimps_string_table_grow(wimps_string_table* const table) {
+    const size_t slotCount = table->slotCount == 0 ? 1024 : table->slotCount * 2;
+
+    size_t* const slots = calloc(slotCount, sizeof(size_t));
+    if(slots == NULL) {
+        return WIMPS_ERROR_MALLOC_FAILED;
+    }
+
+    char** const strings = realloc(table->strings, slotCount / 2 * sizeof(char*));
+    if(strings == NULL) {
+        free(slots);
+        return WIMPS_ERROR_REALLOC_FAILED;
+    }
+
+    for(size_t id = 0; id < table->count; ++id) {
+        size_t slot = wimps_hash_string(strings[id], strlen(strings[id])) & (slotCount - 1);
+
+        while(slots[slot] != 0) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+
+        slots[slot] = id + 1;
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->slotCount = slotCount;
+    table->strings = strings;
+
+    return WIMPS_ERROR_NONE;
+}
+
+// sets *outId to the id of the string, adding it if it hasn't been seen before
+ErrorCode wimps_string_table_intern(wimps_string_table* const table, const char* const string, const size_t length, size_t* const outId) {
+    // keep the table at most half full
+    if(table->count + 1 > table->slotCount / 2) {
+        const ErrorCode error = wimps_string_table_grow(table);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+    }
+
+    size_t slot = wimps_hash_string(string, length) & (table->slotCount - 1);
+
+    while(table->slots[slot] != 0) {
+        const size_t id = table->slots[slot] - 1;
+
+        if(strncmp(table->strings[id], string, length) == 0 && table->strings[id][length] == '\0') {
+            *outId = id;
+            return WIMPS_ERROR_NONE;
+        }
+
+        slot = (slot + 1) & (table->slotCount - 1);
+    }
+
+    char* const copy = strndup(string, length);
+    if(copy == NULL) {
+        return WIMPS_ERROR_STRNDUP_FAILED;
+    }
+
+    *outId = table->count;
+    table->strings[table->count] = copy;
+    table->count += 1;
+    table->slots[slot] = *outId + 1;
+
+    return WIMPS_ERROR_NONE;
+}
+
+void wimps_string_table_free(wimps_string_table* const table) {
+    for(size_t id = 0; id < table->count; ++id) {
+        free(table->strings[id]);
+    }
+
+    free(table->strings);
+    free(table->slots);
+
+    table->strings = NULL;
+    table->count = 0;
+    table->slots = NULL;
+    table->slotCount = 0;
+}
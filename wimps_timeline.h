@@ -0,0 +1,389 @@
+/*
+    This file is part of wimps.
+
+    wimps is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    wimps is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with wimps.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "error_codes.h"
+#include "wimps_read.h"
+#include "wimps_symbols.h"
+
+// The timeline report splits the trace into fixed length intervals and shows the top functions
+// (the innermost frame of each sample) in each, overall and per thread.
+//
+// It also compares each interval with the one before it, and flags it as a phase change
+// if the stacks it was spending time in are very different (e.g. a GC pause or a batch job kicking in).
+// Whole stacks are compared rather than just the innermost function, since very different phases
+// can still end up in the same place (memcpy, malloc, a shared helper...).
+// The difference is the total variation distance between the two, i.e. the fraction of time that
+// would have to move between stacks to make one look like the other: 0 is identical, 1 is nothing in common.
+//
+// Samples are in time order, so everything happens as the trace is read and
+// only the current and previous interval are ever kept in memory.
+
+typedef struct _wimps_timeline_entry {
+    int32_t thread;
+    // the innermost function, for the top functions
+    size_t function;
+    // a hash of the functions in the whole stack, for phase changes
+    uint64_t stack;
+    uint64_t weight;
+} wimps_timeline_entry;
+
+typedef struct _wimps_timeline_entries {
+    wimps_timeline_entry* entries;
+    size_t count;
+    size_t capacity;
+} wimps_timeline_entries;
+
+typedef struct _wimps_timeline {
+    // settings
+    int64_t intervalLength;
+    size_t topCount;
+    double threshold;
+
+    // keyed by wimps_symbol_function_key
+    wimps_string_table functions;
+    // scratch space for wimps_symbol_function_key
+    char* key;
+    size_t keySize;
+
+    bool started;
+    wimps_timespec start;
+    int64_t interval;
+    uint64_t intervalSamples;
+    uint64_t intervalWeight;
+
+    // one per sample in the current interval
+    wimps_timeline_entries samples;
+    // the current interval's samples summed per stack (thread and function are unused), sorted by stack
+    wimps_timeline_entries current;
+    // the same for the last interval that had any samples
+    wimps_timeline_entries previous;
+    uint64_t previousWeight;
+    // scratch space for summing per function and sorting by weight
+    wimps_timeline_entries ranking;
+} wimps_timeline;
+
+void wimps_timeline_init(wimps_timeline* const timeline, const int64_t intervalLength, const size_t topCount, const double threshold) {
+    memset(timeline, 0, sizeof(*timeline));
+
+    timeline->intervalLength = intervalLength;
+    timeline->topCount = topCount;
+    timeline->threshold = threshold;
+}
+
+void wimps_timeline_free(wimps_timeline* const timeline) {
+    wimps_string_table_free(&timeline->functions);
+    free(timeline->key);
+
+    free(timeline->samples.entries);
+    free(timeline->current.entries);
+    free(timeline->previous.entries);
+    free(timeline->ranking.entries);
+}
+
+ErrorCode wimps_timeline_reserve(wimps_timeline_entries* const entries, const size_t count) {
+    if(count <= entries->capacity) {
+        return WIMPS_ERROR_NONE;
+    }
+
+    size_t capacity = entries->capacity == 0 ? 256 : entries->capacity;
+    while(capacity < count) {
+        capacity *= 2;
+    }
+
+    wimps_timeline_entry* const newEntries = realloc(entries->entries, capacity * sizeof(wimps_timeline_entry));
+    if(newEntries == NULL) {
+        return WIMPS_ERROR_REALLOC_FAILED;
+    }
+
+    entries->entries = newEntries;
+    entries->capacity = capacity;
+
+    return WIMPS_ERROR_NONE;
+}
+
+int wimps_timeline_compare_function(const void* const a, const void* const b) {
+    const wimps_timeline_entry* const lhs = a;
+    const wimps_timeline_entry* const rhs = b;
+
+    return (lhs->function > rhs->function) - (lhs->function < rhs->function);
+}
+
+int wimps_timeline_compare_stack(const void* const a, const void* const b) {
+    const wimps_timeline_entry* const lhs = a;
+    const wimps_timeline_entry* const rhs = b;
+
+    return (lhs->stack > rhs->stack) - (lhs->stack < rhs->stack);
+}
+
+int wimps_timeline_compare_thread_function(const void* const a, const void* const b) {
+    const wimps_timeline_entry* const lhs = a;
+    const wimps_timeline_entry* const rhs = b;
+
+    if(lhs->thread != rhs->thread) {
+        return (lhs->thread > rhs->thread) - (lhs->thread < rhs->thread);
+    }
+
+    return wimps_timeline_compare_function(a, b);
+}
+
+// heaviest first
+int wimps_timeline_compare_weight(const void* const a, const void* const b) {
+    const wimps_timeline_entry* const lhs = a;
+    const wimps_timeline_entry* const rhs = b;
+
+    return (lhs->weight < rhs->weight) - (lhs->weight > rhs->weight);
+}
+
+// sums up runs of entries that compare equal, entries must already be sorted with the same compare
+void wimps_timeline_coalesce(wimps_timeline_entries* const entries, int (*compare)(const void*, const void*)) {
+    size_t out = 0;
+
+    for(size_t i = 0; i < entries->count; ++i) {
+        wimps_timeline_entry* const entry = &entries->entries[i];
+
+        if(out > 0 && compare(&entries->entries[out - 1], entry) == 0) {
+            entries->entries[out - 1].weight += entry->weight;
+        } else {
+            entries->entries[out] = *entry;
+            out += 1;
+        }
+    }
+
+    entries->count = out;
+}
+
+// both must be sorted by stack
+double wimps_timeline_distance(const wimps_timeline_entries* const a, const uint64_t aWeight,
+                               const wimps_timeline_entries* const b, const uint64_t bWeight) {
+    double difference = 0;
+    size_t i = 0;
+    size_t j = 0;
+
+    while(i < a->count || j < b->count) {
+        double aShare = 0;
+        double bShare = 0;
+
+        if(j == b->count || (i < a->count && a->entries[i].stack < b->entries[j].stack)) {
+            aShare = (double) a->entries[i++].weight / aWeight;
+        } else if(i == a->count || b->entries[j].stack < a->entries[i].stack) {
+            bShare = (double) b->entries[j++].weight / bWeight;
+        } else {
+            aShare = (double) a->entries[i++].weight / aWeight;
+            bShare = (double) b->entries[j++].weight / bWeight;
+        }
+
+        difference += aShare > bShare ? aShare - bShare : bShare - aShare;
+    }
+
+    return difference / 2;
+}
+
+// prints the heaviest topCount of entries[0..count) (already summed per function), which get reordered
+void wimps_timeline_print_top(const wimps_timeline* const timeline, wimps_timeline_entry* const entries, const size_t count, const uint64_t totalWeight) {
+    qsort(entries, count, sizeof(wimps_timeline_entry), &wimps_timeline_compare_weight);
+
+    for(size_t i = 0; i < count && i < timeline->topCount; ++i) {
+        printf("\t\t%5.1f%% %s\n",
+               100.0 * entries[i].weight / totalWeight,
+               timeline->functions.strings[entries[i].function]);
+    }
+}
+
+ErrorCode wimps_timeline_finish_interval(wimps_timeline* const timeline) {
+    if(timeline->samples.count == 0) {
+        return WIMPS_ERROR_NONE;
+    }
+
+    ErrorCode error;
+
+    // per stack, to compare with the previous interval
+    error = wimps_timeline_reserve(&timeline->current, timeline->samples.count);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    memcpy(timeline->current.entries, timeline->samples.entries, timeline->samples.count * sizeof(wimps_timeline_entry));
+    timeline->current.count = timeline->samples.count;
+
+    qsort(timeline->current.entries, timeline->current.count, sizeof(wimps_timeline_entry), &wimps_timeline_compare_stack);
+    wimps_timeline_coalesce(&timeline->current, &wimps_timeline_compare_stack);
+
+    const double begin = (double) timeline->interval * timeline->intervalLength / 1e9;
+    const double end = (double) (timeline->interval + 1) * timeline->intervalLength / 1e9;
+
+    printf("Interval %" PRId64 " [%.3fs - %.3fs] %" PRIu64 " samples (~%.3fs)",
+           timeline->interval, begin, end, timeline->intervalSamples, timeline->intervalWeight / 1e9);
+
+    if(timeline->previous.count > 0) {
+        const double distance = wimps_timeline_distance(&timeline->current, timeline->intervalWeight,
+                                                        &timeline->previous, timeline->previousWeight);
+
+        if(distance >= timeline->threshold) {
+            printf(" *** phase change (distance %.2f) ***", distance);
+        }
+    }
+
+    printf("\n\tall threads:\n");
+
+    // overall
+    error = wimps_timeline_reserve(&timeline->ranking, timeline->samples.count);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    memcpy(timeline->ranking.entries, timeline->samples.entries, timeline->samples.count * sizeof(wimps_timeline_entry));
+    timeline->ranking.count = timeline->samples.count;
+
+    qsort(timeline->ranking.entries, timeline->ranking.count, sizeof(wimps_timeline_entry), &wimps_timeline_compare_function);
+    wimps_timeline_coalesce(&timeline->ranking, &wimps_timeline_compare_function);
+    wimps_timeline_print_top(timeline, timeline->ranking.entries, timeline->ranking.count, timeline->intervalWeight);
+
+    // per thread, the samples themselves aren't needed after this so they get sorted in place
+    qsort(timeline->samples.entries, timeline->samples.count, sizeof(wimps_timeline_entry), &wimps_timeline_compare_thread_function);
+    wimps_timeline_coalesce(&timeline->samples, &wimps_timeline_compare_thread_function);
+
+    for(size_t first = 0; first < timeline->samples.count;) {
+        const int32_t thread = timeline->samples.entries[first].thread;
+        uint64_t threadWeight = 0;
+        size_t last = first;
+
+        while(last < timeline->samples.count && timeline->samples.entries[last].thread == thread) {
+            threadWeight += timeline->samples.entries[last].weight;
+            last += 1;
+        }
+
+        // older traces don't say which thread was sampled
+        if(thread != 0) {
+            printf("\tthread %" PRId32 " (%.1f%%):\n", thread, 100.0 * threadWeight / timeline->intervalWeight);
+            wimps_timeline_print_top(timeline, &timeline->samples.entries[first], last - first, threadWeight);
+        }
+
+        first = last;
+    }
+
+    // this interval is the one the next gets compared against
+    wimps_timeline_entries swap = timeline->previous;
+    timeline->previous = timeline->current;
+    timeline->previousWeight = timeline->intervalWeight;
+    timeline->current = swap;
+
+    timeline->samples.count = 0;
+    timeline->intervalSamples = 0;
+    timeline->intervalWeight = 0;
+
+    return WIMPS_ERROR_NONE;
+}
+
+// hashes the functions in the sample's stack, but not where in them it was,
+// so that samples from different lines of the same functions count as the same stack
+ErrorCode wimps_timeline_hash_stack(wimps_timeline* const timeline, const wimps_sample* const sample, uint64_t* const outHash) {
+    uint64_t hash = wimps_hash_string("", 0);
+
+    for(size_t i = 0; i < sample->symbolCount; ++i) {
+        size_t keyLength;
+
+        const ErrorCode error = wimps_symbol_function_key(sample->symbols[i], &timeline->key, &timeline->keySize, &keyLength);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+
+        hash = wimps_hash_append(hash, timeline->key, keyLength);
+        hash = wimps_hash_append(hash, "\n", 1);
+    }
+
+    *outHash = hash;
+    return WIMPS_ERROR_NONE;
+}
+
+// a wimps_sample_callback, context is the wimps_timeline
+ErrorCode wimps_timeline_add_sample(const wimps_trace* const trace, const wimps_sample* const sample, void* const context) {
+    wimps_timeline* const timeline = context;
+
+    if(trace->aggregated) {
+        // count mode doesn't keep the time of anything
+        return WIMPS_ERROR_NO_TIMELINE;
+    }
+
+    if(! timeline->started) {
+        timeline->start = sample->time;
+        timeline->started = true;
+    }
+
+    const int64_t sinceStart = (sample->time.seconds - timeline->start.seconds) * 1000000000LL
+                             + (sample->time.nanoseconds - timeline->start.nanoseconds);
+
+    const int64_t interval = sinceStart / timeline->intervalLength;
+
+    if(interval != timeline->interval) {
+        const ErrorCode error = wimps_timeline_finish_interval(timeline);
+        if(error != WIMPS_ERROR_NONE) {
+            return error;
+        }
+
+        timeline->interval = interval;
+    }
+
+    if(sample->symbolCount == 0) {
+        return WIMPS_ERROR_NONE;
+    }
+
+    uint64_t stack;
+    ErrorCode error = wimps_timeline_hash_stack(timeline, sample, &stack);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    size_t keyLength;
+    size_t function;
+
+    if(   (error = wimps_symbol_function_key(sample->symbols[0], &timeline->key, &timeline->keySize, &keyLength)) != WIMPS_ERROR_NONE
+       || (error = wimps_string_table_intern(&timeline->functions, timeline->key, keyLength, &function)) != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    error = wimps_timeline_reserve(&timeline->samples, timeline->samples.count + 1);
+    if(error != WIMPS_ERROR_NONE) {
+        return error;
+    }
+
+    timeline->samples.entries[timeline->samples.count] = (wimps_timeline_entry) {
+        .thread = sample->thread,
+        .function = function,
+        .stack = stack,
+        .weight = sample->weight
+    };
+
+    timeline->samples.count += 1;
+    timeline->intervalSamples += sample->count;
+    timeline->intervalWeight += sample->weight;
+
+    return WIMPS_ERROR_NONE;
+}
+
+// prints whatever's left once the whole trace has been read
+ErrorCode wimps_timeline_finish(wimps_timeline* const timeline) {
+    return wimps_timeline_finish_interval(timeline);
+}